@@ -24,9 +24,269 @@
 #include "OpenFirmwareManager.h"
 #include "zutil.h"
 
+#include <mach/kmod.h>
+
 #define super IOService
 OSDefineMetaClassAndStructors(OpenFirmwareManager, super)
 
+#define kDecodedCacheCapacity       (8 * 1024 * 1024)
+#define kDecodedCacheFirmwareKey    "Firmware"
+#define kDecodedCacheFingerprintKey "Fingerprint"
+#define kDecodedSizeCapacity        64
+
+// The decoded firmware cache is shared by all managers and only set up and torn down by the module start and stop routines.
+static IOLock * sDecodedCacheLock = NULL;
+static OSDictionary * sDecodedCache = NULL;
+static OSArray * sDecodedCacheOrder = NULL;
+static UInt32 sDecodedCacheSize = 0;
+static OSDictionary * sDecodedSizes = NULL;
+
+static void computeFingerprint(const void * firmware, UInt32 firmwareSize, FirmwareFingerprint * fingerprint)
+{
+    SHA256_CTX context;
+
+    SHA256_Init(&context);
+    SHA256_Update(&context, firmware, firmwareSize);
+    SHA256_Final(fingerprint->hash, &context);
+    fingerprint->size = firmwareSize;
+}
+
+static const OSSymbol * copyDecodedCacheKey(const FirmwareFingerprint * fingerprint)
+{
+    char key[SHA256_DIGEST_LENGTH * 2 + 10];
+    int i;
+
+    for ( i = 0; i < SHA256_DIGEST_LENGTH; ++i )
+        snprintf(key + i * 2, 3, "%02x", fingerprint->hash[i]);
+    snprintf(key + i * 2, sizeof(key) - i * 2, "-%08x", fingerprint->size);
+
+    return OSSymbol::withCString(key);
+}
+
+static OSData * copyDecodedFirmware(const FirmwareFingerprint * source, FirmwareFingerprint * fingerprint, bool * fingerprinted)
+{
+    OSDictionary * entry;
+    OSData * fwData = NULL;
+    OSData * fingerprintData;
+    const OSSymbol * key;
+    unsigned int index;
+
+    if ( !sDecodedCacheLock )
+        return NULL;
+
+    key = copyDecodedCacheKey(source);
+    if ( !key )
+        return NULL;
+
+    IOLockLock(sDecodedCacheLock);
+    entry = sDecodedCache ? OSDynamicCast(OSDictionary, sDecodedCache->getObject(key)) : NULL;
+    if ( entry )
+    {
+        fwData = OSDynamicCast(OSData, entry->getObject(kDecodedCacheFirmwareKey));
+        fingerprintData = OSDynamicCast(OSData, entry->getObject(kDecodedCacheFingerprintKey));
+        if ( fwData )
+        {
+            fwData->retain();
+
+            // the fingerprint is only there once a client has asked for it
+            *fingerprinted = fingerprintData != NULL;
+            if ( fingerprintData )
+                memcpy(fingerprint, fingerprintData->getBytesNoCopy(), sizeof(FirmwareFingerprint));
+
+            // move the entry to the back, so that the least recently used one is evicted first
+            index = sDecodedCacheOrder->getNextIndexOfObject(key, 0);
+            if ( index != (unsigned int) -1 )
+            {
+                sDecodedCacheOrder->removeObject(index);
+                sDecodedCacheOrder->setObject(key);
+            }
+        }
+    }
+    IOLockUnlock(sDecodedCacheLock);
+
+    OSSafeReleaseNULL(key);
+    return fwData;
+}
+
+static void setDecodedFingerprint(OSData * firmware, const FirmwareFingerprint * fingerprint)
+{
+    OSCollectionIterator * iterator;
+    OSDictionary * entry;
+    OSData * fingerprintData;
+    const OSSymbol * key;
+
+    if ( !sDecodedCacheLock )
+        return;
+
+    fingerprintData = OSData::withBytes(fingerprint, sizeof(FirmwareFingerprint));
+    if ( !fingerprintData )
+        return;
+
+    IOLockLock(sDecodedCacheLock);
+    iterator = sDecodedCache ? OSCollectionIterator::withCollection(sDecodedCache) : NULL;
+    if ( iterator )
+    {
+        while ( (key = OSDynamicCast(OSSymbol, iterator->getNextObject())) )
+        {
+            entry = OSDynamicCast(OSDictionary, sDecodedCache->getObject(key));
+            if ( entry && entry->getObject(kDecodedCacheFirmwareKey) == firmware )
+            {
+                entry->setObject(kDecodedCacheFingerprintKey, fingerprintData);
+                break;
+            }
+        }
+        OSSafeReleaseNULL(iterator);
+    }
+    IOLockUnlock(sDecodedCacheLock);
+
+    OSSafeReleaseNULL(fingerprintData);
+}
+
+static void trimDecodedCache(UInt32 budget)
+{
+    OSDictionary * entry;
+    OSData * fwData;
+    const OSSymbol * key;
+
+    // sDecodedCacheLock must be held
+    while ( sDecodedCacheSize > budget && sDecodedCacheOrder && sDecodedCacheOrder->getCount() )
+    {
+        key = OSDynamicCast(OSSymbol, sDecodedCacheOrder->getObject(0));
+        entry = key ? OSDynamicCast(OSDictionary, sDecodedCache->getObject(key)) : NULL;
+        fwData = entry ? OSDynamicCast(OSData, entry->getObject(kDecodedCacheFirmwareKey)) : NULL;
+        if ( fwData )
+            sDecodedCacheSize -= fwData->getLength();
+        if ( key )
+            sDecodedCache->removeObject(key);
+        sDecodedCacheOrder->removeObject(0);
+    }
+}
+
+static void cacheDecodedFirmware(const FirmwareFingerprint * source, OSData * firmware)
+{
+    OSDictionary * entry;
+    const OSSymbol * key;
+
+    if ( !sDecodedCacheLock )
+        return;
+
+    key = copyDecodedCacheKey(source);
+    entry = OSDictionary::withCapacity(2);
+    if ( !key || !entry || !entry->setObject(kDecodedCacheFirmwareKey, firmware) )
+        goto OVER;
+
+    IOLockLock(sDecodedCacheLock);
+    if ( !sDecodedCache )
+        sDecodedCache = OSDictionary::withCapacity(4);
+    if ( !sDecodedCacheOrder )
+        sDecodedCacheOrder = OSArray::withCapacity(4);
+
+    if ( sDecodedCache && sDecodedCacheOrder && !sDecodedCache->getObject(key) && firmware->getLength() <= kDecodedCacheCapacity )
+    {
+        trimDecodedCache(kDecodedCacheCapacity - firmware->getLength());
+        if ( sDecodedCache->setObject(key, entry) )
+        {
+            if ( sDecodedCacheOrder->setObject(key) )
+                sDecodedCacheSize += firmware->getLength();
+            else
+                sDecodedCache->removeObject(key);
+        }
+        DebugLog("cacheDecodedFirmware", "Decoded cache holds %d bytes.", sDecodedCacheSize);
+    }
+    IOLockUnlock(sDecodedCacheLock);
+
+OVER:
+    OSSafeReleaseNULL(entry);
+    OSSafeReleaseNULL(key);
+}
+
+static UInt32 getDecodedSize(const FirmwareFingerprint * source)
+{
+    OSNumber * size = NULL;
+    const OSSymbol * key;
+    UInt32 result = 0;
+
+    if ( !sDecodedCacheLock )
+        return 0;
+
+    key = copyDecodedCacheKey(source);
+    if ( !key )
+        return 0;
+
+    IOLockLock(sDecodedCacheLock);
+    if ( sDecodedSizes )
+        size = OSDynamicCast(OSNumber, sDecodedSizes->getObject(key));
+    if ( size )
+        result = size->unsigned32BitValue();
+    IOLockUnlock(sDecodedCacheLock);
+
+    OSSafeReleaseNULL(key);
+    return result;
+}
+
+static void setDecodedSize(const FirmwareFingerprint * source, UInt32 size)
+{
+    OSNumber * number;
+    const OSSymbol * key;
+
+    if ( !sDecodedCacheLock )
+        return;
+
+    key = copyDecodedCacheKey(source);
+    number = OSNumber::withNumber(size, 32);
+    if ( key && number )
+    {
+        IOLockLock(sDecodedCacheLock);
+        if ( !sDecodedSizes )
+            sDecodedSizes = OSDictionary::withCapacity(4);
+
+        // the sizes are tiny, so they are simply dropped all at once when there are too many
+        if ( sDecodedSizes && sDecodedSizes->getCount() >= kDecodedSizeCapacity && !sDecodedSizes->getObject(key) )
+            sDecodedSizes->flushCollection();
+        if ( sDecodedSizes )
+            sDecodedSizes->setObject(key, number);
+        IOLockUnlock(sDecodedCacheLock);
+    }
+
+    OSSafeReleaseNULL(number);
+    OSSafeReleaseNULL(key);
+}
+
+static void initDecodedCache()
+{
+    // failing here only leaves the cache disabled
+    sDecodedCacheLock = IOLockAlloc();
+}
+
+static void freeDecodedCache()
+{
+    // the kext only unloads once every manager is gone, so nothing else can use the cache anymore
+    if ( !sDecodedCacheLock )
+        return;
+
+    IOLockLock(sDecodedCacheLock);
+    OSSafeReleaseNULL(sDecodedCache);
+    OSSafeReleaseNULL(sDecodedCacheOrder);
+    OSSafeReleaseNULL(sDecodedSizes);
+    sDecodedCacheSize = 0;
+    IOLockUnlock(sDecodedCacheLock);
+
+    IOLockFree(sDecodedCacheLock);
+    sDecodedCacheLock = NULL;
+}
+
+extern "C" kern_return_t OpenFirmwareManager_start(kmod_info_t * ki, void * data)
+{
+    initDecodedCache();
+    return KERN_SUCCESS;
+}
+
+extern "C" kern_return_t OpenFirmwareManager_stop(kmod_info_t * ki, void * data)
+{
+    freeDecodedCache();
+    return KERN_SUCCESS;
+}
+
 bool OpenFirmwareManager::init(OSDictionary * dictionary)
 {
     DebugLog("init", "Initializing variables...");
@@ -42,6 +302,15 @@ bool OpenFirmwareManager::init(OSDictionary * dictionary)
         return false;
     }
     mExpansionData->mCompletionLock = IOLockAlloc();
+    mExpansionData->mPendingRequests = NULL;
+    mExpansionData->mFingerprints = NULL;
+    mExpansionData->mDecodedCacheLimit = kDecodedCacheCapacity;
+    mExpansionData->mDecodeCall = thread_call_allocate(decodeThreadCall, this);
+    if ( !mExpansionData->mDecodeCall )
+    {
+        AlwaysLog("init", "init() failed -- unable to allocate thread call.");
+        return false;
+    }
     DebugLog("init", "init() completed.");
     return true;
 }
@@ -50,6 +319,13 @@ void OpenFirmwareManager::free()
 {
     DebugLog("free", "Releasing variables...");
     removeFirmwares();
+    OSSafeReleaseNULL(mExpansionData->mFingerprints);
+    if ( mExpansionData->mDecodeCall )
+    {
+        // every entered invocation holds a reference until it returns, so none can be pending or running past its final release
+        thread_call_cancel(mExpansionData->mDecodeCall);
+        thread_call_free(mExpansionData->mDecodeCall);
+    }
     IOLockFree(mFirmwareLock);
     IOLockFree(mExpansionData->mCompletionLock);
     IOSafeDeleteNULL(mExpansionData, ExpansionData, 1);
@@ -68,14 +344,101 @@ bool OpenFirmwareManager::isFirmwareCompressed(OSData * firmware)
     return false;
 }
 
+IOReturn OpenFirmwareManager::inflateFirmware(const void * firmware, UInt32 firmwareSize, void * buffer, UInt32 bufferSize, UInt32 * length)
+{
+    z_stream zstream;
+    int zlib_result;
+    IOReturn err;
+
+    *length = 0;
+
+    bzero(&zstream, sizeof(zstream));
+    zstream.next_in   = (UInt8 *) firmware;
+    zstream.avail_in  = firmwareSize;
+    zstream.next_out  = (UInt8 *) buffer;
+    zstream.avail_out = bufferSize;
+    zstream.zalloc    = zalloc;
+    zstream.zfree     = zfree;
+
+    zlib_result = inflateInit(&zstream);
+    if ( zlib_result != Z_OK )
+    {
+        DebugLog("inflateFirmware", "inflateInit() failed: %d", zlib_result);
+        return kIOReturnError;
+    }
+
+    zlib_result = inflate(&zstream, Z_FINISH);
+    *length = (UInt32) zstream.total_out;
+
+    // with Z_FINISH, a truncated or corrupt stream also ends in Z_BUF_ERROR, so only a full buffer means it is too small
+    if ( zlib_result == Z_STREAM_END )
+        err = kIOReturnSuccess;
+    else if ( zstream.avail_out == 0 )
+        err = kIOReturnNoSpace;
+    else
+    {
+        DebugLog("inflateFirmware", "inflate() failed: %d", zlib_result);
+        err = kIOReturnError;
+    }
+
+    inflateEnd(&zstream);
+    return err;
+}
+
+IOReturn OpenFirmwareManager::measureFirmware(const void * firmware, UInt32 firmwareSize, UInt32 * length)
+{
+    z_stream zstream;
+    int zlib_result;
+    void * scratch;
+
+    *length = 0;
+
+    scratch = IOMalloc(PAGE_SIZE);
+    if ( !scratch )
+        return kIOReturnNoMemory;
+
+    bzero(&zstream, sizeof(zstream));
+    zstream.next_in   = (UInt8 *) firmware;
+    zstream.avail_in  = firmwareSize;
+    zstream.zalloc    = zalloc;
+    zstream.zfree     = zfree;
+
+    zlib_result = inflateInit(&zstream);
+    if ( zlib_result != Z_OK )
+    {
+        DebugLog("measureFirmware", "inflateInit() failed: %d", zlib_result);
+        IOFree(scratch, PAGE_SIZE);
+        return kIOReturnError;
+    }
+
+    // the output is discarded, only its size is of interest
+    do
+    {
+        zstream.next_out  = (UInt8 *) scratch;
+        zstream.avail_out = PAGE_SIZE;
+        zlib_result = inflate(&zstream, Z_NO_FLUSH);
+    } while ( zlib_result == Z_OK );
+    *length = (UInt32) zstream.total_out;
+
+    inflateEnd(&zstream);
+    IOFree(scratch, PAGE_SIZE);
+
+    if ( zlib_result != Z_STREAM_END )
+    {
+        DebugLog("measureFirmware", "inflate() failed: %d", zlib_result);
+        return kIOReturnError;
+    }
+    return kIOReturnSuccess;
+}
+
 OSData * OpenFirmwareManager::decompressFirmware(OSData * firmware)
 {
     DebugLog("decompressFirmware", "Uncompressing firmware %p...", firmware);
     OSData * uncompressedFirmware = NULL;
-    z_stream zstream;
-    int zlib_result;
     void * buffer = NULL;
     UInt32 bufferSize = 0;
+    UInt32 length;
+    IOReturn err;
 
     if ( !isFirmwareCompressed(firmware) )
     {
@@ -85,36 +448,146 @@ OSData * OpenFirmwareManager::decompressFirmware(OSData * firmware)
     }
 
     bufferSize = firmware->getLength() * 4;
-    buffer = IOMalloc(bufferSize);
+    while ( true )
+    {
+        buffer = IOMalloc(bufferSize);
+        if ( !buffer )
+            return NULL;
 
-    bzero(&zstream, sizeof(zstream));
-    zstream.next_in   = (UInt8 *) firmware->getBytesNoCopy();
-    zstream.avail_in  = firmware->getLength();
-    zstream.next_out  = (UInt8 *) buffer;
-    zstream.avail_out = bufferSize;
-    zstream.zalloc    = zalloc;
-    zstream.zfree     = zfree;
+        err = inflateFirmware(firmware->getBytesNoCopy(), firmware->getLength(), buffer, bufferSize, &length);
+        if ( err == kIOReturnSuccess )
+            uncompressedFirmware = OSData::withBytes(buffer, length);
 
-    zlib_result = inflateInit(&zstream);
-    if ( zlib_result != Z_OK )
-    {
-        DebugLog("decompressFirmware", "inflateInit() failed: %d", zlib_result);
         IOFree(buffer, bufferSize);
-        return NULL;
-    }
 
-    zlib_result = inflate(&zstream, Z_FINISH);
-    if ( zlib_result == Z_STREAM_END || zlib_result == Z_OK )
-        uncompressedFirmware = OSData::withBytes(buffer, (unsigned int) zstream.total_out);
+        // firmwares that compress better than 4:1 do not fit the first estimate
+        if ( err != kIOReturnNoSpace || bufferSize > UINT32_MAX / 2 )
+            break;
+        bufferSize *= 2;
+    }
 
-    inflateEnd(&zstream);
-    IOFree(buffer, bufferSize);
+    if ( !uncompressedFirmware )
+        return NULL;
 
     DebugLog("decompressFirmware", "Firmware decompressed successfully.");
 
     return uncompressedFirmware;
 }
 
+IOReturn OpenFirmwareManager::decompressFirmwareToBuffer(FirmwareDescriptor firmware, IOBufferMemoryDescriptor * buffer)
+{
+    DebugLog("decompressFirmwareToBuffer", "name: %s -- buffer: %p", firmware.name, buffer);
+    IOReturn err;
+    UInt32 length;
+
+    if ( !buffer || !firmware.firmwareData || firmware.firmwareSize < sizeof(UInt16) )
+        return kIOReturnBadArgument;
+
+    OSData * fwData = OSData::withBytesNoCopy(firmware.firmwareData, firmware.firmwareSize);
+    if ( !fwData )
+        return kIOReturnNoMemory;
+    bool compressed = isFirmwareCompressed(fwData);
+    OSSafeReleaseNULL(fwData);
+
+    if ( !compressed )
+    {
+        if ( firmware.firmwareSize > buffer->getCapacity() )
+            return kIOReturnNoSpace;
+        memcpy(buffer->getBytesNoCopy(), firmware.firmwareData, firmware.firmwareSize);
+        buffer->setLength(firmware.firmwareSize);
+        return kIOReturnSuccess;
+    }
+
+    err = inflateFirmware(firmware.firmwareData, firmware.firmwareSize, buffer->getBytesNoCopy(), (UInt32) buffer->getCapacity(), &length);
+    if ( err == kIOReturnNoSpace )
+        DebugLog("decompressFirmwareToBuffer", "Buffer is too small: %llu bytes.", (UInt64) buffer->getCapacity());
+    if ( err )
+        return err;
+
+    buffer->setLength(length);
+    DebugLog("decompressFirmwareToBuffer", "Firmware decompressed successfully: %d bytes.", length);
+    return kIOReturnSuccess;
+}
+
+IOBufferMemoryDescriptor * OpenFirmwareManager::copyFirmwareBuffer(FirmwareDescriptor firmware, IOOptionBits options, mach_vm_address_t physicalMask, UInt32 size)
+{
+    DebugLog("copyFirmwareBuffer", "name: %s -- options: %08x -- physicalMask: %llx -- size: %d", firmware.name, options, physicalMask, size);
+    IOBufferMemoryDescriptor * buffer = NULL;
+    OSData * fwData;
+    OSData * cachedFirmware = NULL;
+    FirmwareFingerprint source;
+    FirmwareFingerprint fingerprint;
+    bool fingerprinted;
+    bool hashed = false;
+    bool measured = false;
+    IOReturn err;
+
+    if ( !firmware.firmwareData || firmware.firmwareSize < sizeof(UInt16) )
+        return NULL;
+
+    fwData = OSData::withBytesNoCopy(firmware.firmwareData, firmware.firmwareSize);
+    if ( !fwData )
+        return NULL;
+
+    if ( !isFirmwareCompressed(fwData) )
+        size = firmware.firmwareSize;
+    else if ( !size )
+    {
+        // hashing the compressed data is much cheaper than inflating it once more to measure it
+        computeFingerprint(firmware.firmwareData, firmware.firmwareSize, &source);
+        hashed = true;
+        if ( mExpansionData->mDecodedCacheLimit )
+            cachedFirmware = copyDecodedFirmware(&source, &fingerprint, &fingerprinted);
+        size = cachedFirmware ? cachedFirmware->getLength() : getDecodedSize(&source);
+    }
+    OSSafeReleaseNULL(fwData);
+
+    // zlib streams do not record the uncompressed size, so it has to be measured unless it is known
+    if ( !size )
+    {
+        if ( measureFirmware(firmware.firmwareData, firmware.firmwareSize, &size) || !size )
+            return NULL;
+        measured = true;
+
+        // so that the same firmware is measured at most once
+        if ( hashed )
+            setDecodedSize(&source, size);
+    }
+
+    if ( !physicalMask )
+        physicalMask = -((mach_vm_address_t) PAGE_SIZE);
+
+    while ( true )
+    {
+        buffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, options, round_page(size), physicalMask);
+        if ( !buffer )
+        {
+            AlwaysLog("copyFirmwareBuffer", "Failed to allocate %d bytes for firmware %s.", size, firmware.name);
+            break;
+        }
+
+        if ( cachedFirmware )
+        {
+            memcpy(buffer->getBytesNoCopy(), cachedFirmware->getBytesNoCopy(), size);
+            buffer->setLength(size);
+            break;
+        }
+
+        err = decompressFirmwareToBuffer(firmware, buffer);
+        if ( !err )
+            break;
+        OSSafeReleaseNULL(buffer);
+
+        // the size given by the caller is too small, so grow the buffer to the actual size and retry
+        if ( err != kIOReturnNoSpace || measured || measureFirmware(firmware.firmwareData, firmware.firmwareSize, &size) )
+            break;
+        measured = true;
+    }
+
+    OSSafeReleaseNULL(cachedFirmware);
+    return buffer;
+}
+
 void OpenFirmwareManager::requestResourceCallback(OSKextRequestTag requestTag, OSReturn result, const void * resourceData, uint32_t resourceDataLength, void * context1)
 {
     ResourceCallbackContext * context = (ResourceCallbackContext *) context1;
@@ -136,6 +609,66 @@ void OpenFirmwareManager::requestResourceCallback(OSKextRequestTag requestTag, O
     IOLockWakeup(context->me->mExpansionData->mCompletionLock, context->me, true);
 }
 
+void OpenFirmwareManager::requestResourceAsyncCallback(OSKextRequestTag requestTag, OSReturn result, const void * resourceData, uint32_t resourceDataLength, void * context)
+{
+    FirmwareRequest * request = (FirmwareRequest *) context;
+    OSData * fwData = NULL;
+
+    if ( kOSReturnSuccess == result && resourceDataLength < sizeof(UInt16) )
+        result = kIOReturnBadArgument;
+
+    if ( kOSReturnSuccess == result )
+    {
+        DebugLog("requestResourceAsyncCallback", "%d bytes of data.", resourceDataLength);
+
+        // the resource data is only valid for the duration of the callback
+        fwData = OSData::withBytes(resourceData, resourceDataLength);
+        if ( !fwData )
+            result = kIOReturnNoMemory;
+    }
+    else
+        DebugLog("requestResourceAsyncCallback", "Retrieved error: %08x", result);
+
+    // the request may be completed by a running decodeThreadCall before readyFirmwareRequest returns,
+    // dropping the reference it holds, and this thread holds none of its own
+    OpenFirmwareManager * me = request->me;
+    me->retain();
+    me->readyFirmwareRequest(request, fwData, result);
+    me->release();
+    OSSafeReleaseNULL(fwData);
+}
+
+void OpenFirmwareManager::decodeThreadCall(thread_call_param_t param0, thread_call_param_t param1)
+{
+    OpenFirmwareManager * me = (OpenFirmwareManager *) param0;
+    FirmwareRequest * request;
+
+    while ( true )
+    {
+        IOLockLock(me->mFirmwareLock);
+        for ( request = me->mExpansionData->mPendingRequests; request; request = request->next )
+        {
+            if ( request->ready && !request->decoding )
+                break;
+        }
+        if ( !request )
+        {
+            IOLockUnlock(me->mFirmwareLock);
+            break;
+        }
+        request->decoding = true;
+        IOLockUnlock(me->mFirmwareLock);
+
+        if ( request->status == kIOReturnSuccess )
+            request->status = me->addFirmwareWithData(request->name->getCStringNoCopy(), request->firmware);
+
+        me->completeFirmwareRequest(request);
+    }
+
+    // taken in readyFirmwareRequest() when this invocation was entered
+    me->release();
+}
+
 IOReturn OpenFirmwareManager::addFirmwareWithName(const char * name, FirmwareDescriptor * firmwareCandidates, int numFirmwares)
 {
     DebugLog("addFirmwareWithName", "name: %s -- firmwareCandidates: %p -- numFirmwares: %d", name, firmwareCandidates, numFirmwares);
@@ -153,7 +686,7 @@ IOReturn OpenFirmwareManager::addFirmwareWithName(const char * name, FirmwareDes
 IOReturn OpenFirmwareManager::addFirmwareWithDescriptor(FirmwareDescriptor firmware)
 {
     DebugLog("addFirmwareWithDescriptor", "name: %s -- firmwareData: %p -- firmwareSize: %d", firmware.name, firmware.firmwareData, firmware.firmwareSize);
-    IOReturn err = kIOReturnSuccess;
+    IOReturn err;
 
     IOLockLock(mFirmwareLock);
     if ( !mFirmwares )
@@ -163,34 +696,91 @@ IOReturn OpenFirmwareManager::addFirmwareWithDescriptor(FirmwareDescriptor firmw
     }
     IOLockUnlock(mFirmwareLock);
 
-    OSData * uncompressedFirmware;
     OSData * fwData = OSData::withBytes(firmware.firmwareData, firmware.firmwareSize);
     if ( !fwData )
         return kIOReturnInvalid;
 
-    if ( isFirmwareCompressed(fwData) )
+    err = addFirmwareWithData(firmware.name, fwData);
+    OSSafeReleaseNULL(fwData);
+    return err;
+}
+
+IOReturn OpenFirmwareManager::addFirmwareWithData(const char * name, OSData * firmware)
+{
+    DebugLog("addFirmwareWithData", "name: %s -- firmware: %p", name, firmware);
+    IOReturn err = kIOReturnSuccess;
+    OSData * uncompressedFirmware = NULL;
+    OSData * fingerprintData = NULL;
+    FirmwareFingerprint source;
+    FirmwareFingerprint fingerprint;
+    bool fingerprinted = false;
+
+    if ( isFirmwareCompressed(firmware) )
+    {
+        // the source is only hashed to look the firmware up in the cache
+        bool cached = mExpansionData->mDecodedCacheLimit != 0;
+
+        if ( cached )
+        {
+            computeFingerprint(firmware->getBytesNoCopy(), firmware->getLength(), &source);
+            uncompressedFirmware = copyDecodedFirmware(&source, &fingerprint, &fingerprinted);
+        }
+        if ( uncompressedFirmware )
+            DebugLog("addFirmwareWithData", "Reusing the decoded firmware from the cache.");
+        else
+        {
+            uncompressedFirmware = decompressFirmware(firmware);
+            if ( !uncompressedFirmware )
+                return kIOReturnError;
+            if ( cached )
+                setDecodedSize(&source, uncompressedFirmware->getLength());
+            if ( cached && uncompressedFirmware->getLength() <= mExpansionData->mDecodedCacheLimit )
+                cacheDecodedFirmware(&source, uncompressedFirmware);
+        }
+    }
+    else
+    {
+        firmware->retain();
+        uncompressedFirmware = firmware;
+    }
+
+    // otherwise the fingerprint is computed by the first call to getFirmwareFingerprint()
+    if ( fingerprinted )
     {
-        uncompressedFirmware = decompressFirmware(fwData);
-        OSSafeReleaseNULL(fwData);
-        if ( !uncompressedFirmware )
-            return kIOReturnError;
-        goto SET_FIRMWARE;
+        fingerprintData = OSData::withBytes(&fingerprint, sizeof(fingerprint));
+        if ( !fingerprintData )
+        {
+            OSSafeReleaseNULL(uncompressedFirmware);
+            return kIOReturnNoMemory;
+        }
     }
-    uncompressedFirmware = fwData;
 
-SET_FIRMWARE:
     IOLockLock(mFirmwareLock);
-    if ( !mFirmwares->setObject(firmware.name, uncompressedFirmware) )
+    if ( !mFirmwares || !mFirmwares->setObject(name, uncompressedFirmware) )
+        err = kIOReturnError;
+    else if ( !fingerprintData )
+        mExpansionData->mFingerprints->removeObject(name);
+    else if ( !mExpansionData->mFingerprints->setObject(name, fingerprintData) )
+    {
+        mFirmwares->removeObject(name);
         err = kIOReturnError;
+    }
+    IOLockUnlock(mFirmwareLock);
 
+    OSSafeReleaseNULL(fingerprintData);
     OSSafeReleaseNULL(uncompressedFirmware);
 
-OVER:
-    IOLockUnlock(mFirmwareLock);
-    DebugLog("addFirmwareWithDescriptor", "Firmware is added successfully!");
+    if ( err == kIOReturnSuccess )
+        DebugLog("addFirmwareWithData", "Firmware is added successfully!");
     return err;
 }
 
+void OpenFirmwareManager::setDecodedCacheLimit(UInt32 limit)
+{
+    DebugLog("setDecodedCacheLimit", "limit: %d", limit);
+    mExpansionData->mDecodedCacheLimit = limit;
+}
+
 IOReturn OpenFirmwareManager::addFirmwareWithFile(const char * kextIdentifier, const char * fileName)
 {
     DebugLog("addFirmwareWithDescriptor", "identifier: %s -- file name: %s", kextIdentifier, fileName);
@@ -214,6 +804,205 @@ IOReturn OpenFirmwareManager::addFirmwareWithFile(const char * kextIdentifier, c
     return addFirmwareWithDescriptor(context.descriptor);
 }
 
+IOReturn OpenFirmwareManager::addFirmwareWithDescriptorAsync(FirmwareDescriptor firmware, FirmwareCompletionAction action, OSObject * owner)
+{
+    DebugLog("addFirmwareWithDescriptorAsync", "name: %s -- firmwareData: %p -- firmwareSize: %d", firmware.name, firmware.firmwareData, firmware.firmwareSize);
+    IOReturn err;
+    FirmwareRequest * request;
+
+    // checked here, as a bad descriptor would otherwise only fail on the thread call
+    if ( !firmware.name || !firmware.firmwareData || firmware.firmwareSize < sizeof(UInt16) )
+        return kIOReturnBadArgument;
+
+    request = enqueueFirmwareRequest(firmware.name, action, owner, &err);
+
+    if ( !request )
+        return err;
+
+    // the descriptor may not outlive this call, so the data is copied before handing it over
+    OSData * fwData = OSData::withBytes(firmware.firmwareData, firmware.firmwareSize);
+    readyFirmwareRequest(request, fwData, fwData ? kIOReturnSuccess : kIOReturnNoMemory);
+    OSSafeReleaseNULL(fwData);
+    return kIOReturnSuccess;
+}
+
+IOReturn OpenFirmwareManager::addFirmwareWithNameAsync(const char * name, FirmwareDescriptor * firmwareCandidates, int numFirmwares, FirmwareCompletionAction action, OSObject * owner)
+{
+    DebugLog("addFirmwareWithNameAsync", "name: %s -- firmwareCandidates: %p -- numFirmwares: %d", name, firmwareCandidates, numFirmwares);
+    while ( --numFirmwares >= 0 )
+    {
+        if ( !strncmp(firmwareCandidates[numFirmwares].name, name, 64) )
+            return addFirmwareWithDescriptorAsync(firmwareCandidates[numFirmwares], action, owner);
+    }
+
+    AlwaysLog("addFirmwareWithNameAsync", "can't find the firmware with name!");
+    return kIOReturnUnsupported;
+}
+
+IOReturn OpenFirmwareManager::addFirmwareWithFileAsync(const char * kextIdentifier, const char * fileName, FirmwareCompletionAction action, OSObject * owner)
+{
+    DebugLog("addFirmwareWithFileAsync", "identifier: %s -- file name: %s", kextIdentifier, fileName);
+    IOReturn err;
+    FirmwareRequest * request = enqueueFirmwareRequest(fileName, action, owner, &err);
+
+    if ( !request )
+        return err;
+
+    OSReturn ret = OSKextRequestResource(kextIdentifier, fileName, requestResourceAsyncCallback, request, NULL);
+    DebugLog("addFirmwareWithFileAsync", "OSKextRequestResource: %08x", ret);
+
+    // the callback is never invoked if the request could not be made, so finish it here
+    if ( ret != kOSReturnSuccess )
+        readyFirmwareRequest(request, NULL, ret);
+    return kIOReturnSuccess;
+}
+
+OpenFirmwareManager::FirmwareRequest * OpenFirmwareManager::enqueueFirmwareRequest(const char * name, FirmwareCompletionAction action, OSObject * owner, IOReturn * err)
+{
+    FirmwareRequest * request;
+    FirmwareRequest * pending;
+    FirmwareWaiter ** tail;
+    FirmwareWaiter * waiter;
+    const OSSymbol * symbol;
+
+    *err = kIOReturnSuccess;
+
+    symbol = OSSymbol::withCString(name);
+    if ( !symbol )
+    {
+        *err = kIOReturnNoMemory;
+        return NULL;
+    }
+
+    waiter = IONew(FirmwareWaiter, 1);
+    if ( !waiter )
+    {
+        OSSafeReleaseNULL(symbol);
+        *err = kIOReturnNoMemory;
+        return NULL;
+    }
+    waiter->next = NULL;
+    waiter->action = action;
+    waiter->owner = owner;
+    if ( owner )
+        owner->retain();
+
+    IOLockLock(mFirmwareLock);
+    if ( !mFirmwares )
+    {
+        IOLockUnlock(mFirmwareLock);
+        OSSafeReleaseNULL(waiter->owner);
+        IOSafeDeleteNULL(waiter, FirmwareWaiter, 1);
+        OSSafeReleaseNULL(symbol);
+        *err = kIOReturnInvalid;
+        return NULL;
+    }
+
+    // merge into a request that is still pending for the same firmware
+    for ( pending = mExpansionData->mPendingRequests; pending; pending = pending->next )
+    {
+        if ( pending->name != symbol )
+            continue;
+
+        for ( tail = &pending->waiters; *tail; tail = &(*tail)->next );
+        *tail = waiter;
+        IOLockUnlock(mFirmwareLock);
+
+        DebugLog("enqueueFirmwareRequest", "Merged request for firmware %s.", name);
+        OSSafeReleaseNULL(symbol);
+        return NULL;
+    }
+
+    request = IONew(FirmwareRequest, 1);
+    if ( !request )
+    {
+        IOLockUnlock(mFirmwareLock);
+        OSSafeReleaseNULL(waiter->owner);
+        IOSafeDeleteNULL(waiter, FirmwareWaiter, 1);
+        OSSafeReleaseNULL(symbol);
+        *err = kIOReturnNoMemory;
+        return NULL;
+    }
+    request->me = this;
+    request->name = symbol;
+    request->firmware = NULL;
+    request->status = kIOReturnSuccess;
+    request->ready = false;
+    request->decoding = false;
+    request->waiters = waiter;
+    request->next = mExpansionData->mPendingRequests;
+    mExpansionData->mPendingRequests = request;
+
+    // released in completeFirmwareRequest()
+    retain();
+    IOLockUnlock(mFirmwareLock);
+
+    DebugLog("enqueueFirmwareRequest", "Queued request for firmware %s.", name);
+    return request;
+}
+
+void OpenFirmwareManager::readyFirmwareRequest(FirmwareRequest * request, OSData * firmware, IOReturn status)
+{
+    IOLockLock(mFirmwareLock);
+    if ( firmware )
+        firmware->retain();
+    request->firmware = firmware;
+    request->status = status;
+    request->ready = true;
+
+    // taken while the request still holds its reference, and dropped by the invocation of decodeThreadCall
+    retain();
+    IOLockUnlock(mFirmwareLock);
+
+    // an invocation that is already pending holds its own reference and will pick up the request
+    if ( thread_call_enter(mExpansionData->mDecodeCall) )
+        release();
+}
+
+void OpenFirmwareManager::completeFirmwareRequest(FirmwareRequest * request)
+{
+    FirmwareRequest ** link;
+    FirmwareWaiter * waiter;
+    OSData * fwData = NULL;
+
+    IOLockLock(mFirmwareLock);
+    for ( link = &mExpansionData->mPendingRequests; *link; link = &(*link)->next )
+    {
+        if ( *link == request )
+        {
+            *link = request->next;
+            break;
+        }
+    }
+    if ( request->status == kIOReturnSuccess && mFirmwares )
+        fwData = OSDynamicCast(OSData, mFirmwares->getObject(request->name));
+    if ( fwData )
+        fwData->retain();
+    else if ( request->status == kIOReturnSuccess )
+        request->status = kIOReturnNotFound;
+
+    // wake tasks in waitForFirmware (in IOLockSleep)...
+    IOLockWakeup(mFirmwareLock, mExpansionData, false);
+    IOLockUnlock(mFirmwareLock);
+
+    DebugLog("completeFirmwareRequest", "Request for firmware %s completed: %08x", request->name->getCStringNoCopy(), request->status);
+
+    while ( (waiter = request->waiters) )
+    {
+        request->waiters = waiter->next;
+        if ( waiter->action )
+            waiter->action(waiter->owner, request->status, request->name->getCStringNoCopy(), fwData);
+        OSSafeReleaseNULL(waiter->owner);
+        IOSafeDeleteNULL(waiter, FirmwareWaiter, 1);
+    }
+
+    OSSafeReleaseNULL(fwData);
+    OSSafeReleaseNULL(request->firmware);
+    OSSafeReleaseNULL(request->name);
+    IOSafeDeleteNULL(request, FirmwareRequest, 1);
+    release();
+}
+
 IOReturn OpenFirmwareManager::removeFirmware(const char * name)
 {
     DebugLog("removeFirmware", "Removing firmware with the name %s", name);
@@ -224,6 +1013,7 @@ IOReturn OpenFirmwareManager::removeFirmware(const char * name)
         return kIOReturnInvalid;
     }
     mFirmwares->removeObject(name);
+    mExpansionData->mFingerprints->removeObject(name);
     IOLockUnlock(mFirmwareLock);
 
     return kIOReturnSuccess;
@@ -239,6 +1029,7 @@ IOReturn OpenFirmwareManager::removeFirmwares()
         return kIOReturnInvalid;
     }
     mFirmwares->flushCollection();
+    mExpansionData->mFingerprints->flushCollection();
     IOLockUnlock(mFirmwareLock);
     return kIOReturnSuccess;
 }
@@ -258,6 +1049,81 @@ OSData * OpenFirmwareManager::getFirmwareUncompressed(const char * name)
     return fwData;
 }
 
+IOReturn OpenFirmwareManager::getFirmwareFingerprint(const char * name, FirmwareFingerprint * fingerprint)
+{
+    OSData * fingerprintData;
+    OSData * fwData;
+
+    IOLockLock(mFirmwareLock);
+    if ( !mFirmwares )
+    {
+        IOLockUnlock(mFirmwareLock);
+        return kIOReturnInvalid;
+    }
+    fingerprintData = OSDynamicCast(OSData, mExpansionData->mFingerprints->getObject(name));
+    if ( fingerprintData && fingerprintData->getLength() == sizeof(FirmwareFingerprint) )
+    {
+        memcpy(fingerprint, fingerprintData->getBytesNoCopy(), sizeof(FirmwareFingerprint));
+        IOLockUnlock(mFirmwareLock);
+        return kIOReturnSuccess;
+    }
+    fwData = OSDynamicCast(OSData, mFirmwares->getObject(name));
+    if ( !fwData )
+    {
+        IOLockUnlock(mFirmwareLock);
+        return kIOReturnNotFound;
+    }
+    fwData->retain();
+    IOLockUnlock(mFirmwareLock);
+
+    // hashed on first use only, so that adding a firmware does not pay for it
+    computeFingerprint(fwData->getBytesNoCopy(), fwData->getLength(), fingerprint);
+    setDecodedFingerprint(fwData, fingerprint);
+
+    fingerprintData = OSData::withBytes(fingerprint, sizeof(FirmwareFingerprint));
+    if ( fingerprintData )
+    {
+        IOLockLock(mFirmwareLock);
+        if ( mFirmwares->getObject(name) == fwData )
+            mExpansionData->mFingerprints->setObject(name, fingerprintData);
+        IOLockUnlock(mFirmwareLock);
+        OSSafeReleaseNULL(fingerprintData);
+    }
+
+    OSSafeReleaseNULL(fwData);
+    return kIOReturnSuccess;
+}
+
+OSData * OpenFirmwareManager::waitForFirmware(const char * name)
+{
+    DebugLog("waitForFirmware", "Waiting for firmware %s...", name);
+    const OSSymbol * symbol = OSSymbol::withCString(name);
+    FirmwareRequest * request;
+    OSData * fwData = NULL;
+
+    if ( !symbol )
+        return NULL;
+
+    IOLockLock(mFirmwareLock);
+    while ( true )
+    {
+        for ( request = mExpansionData->mPendingRequests; request; request = request->next )
+        {
+            if ( request->name == symbol )
+                break;
+        }
+        if ( !request )
+            break;
+        IOLockSleep(mFirmwareLock, mExpansionData, THREAD_UNINT);
+    }
+    if ( mFirmwares )
+        fwData = OSDynamicCast(OSData, mFirmwares->getObject(symbol));
+    IOLockUnlock(mFirmwareLock);
+
+    OSSafeReleaseNULL(symbol);
+    return fwData;
+}
+
 bool OpenFirmwareManager::initWithCapacity(int capacity)
 {
     DebugLog("initWithCapacity", "capacity: %d", capacity);
@@ -267,8 +1133,11 @@ bool OpenFirmwareManager::initWithCapacity(int capacity)
     DebugLog("initWithCapacity", "init() succeeded!");
     IOLockLock(mFirmwareLock);
     mFirmwares = OSDictionary::withCapacity(capacity);
-    if ( !mFirmwares )
+    mExpansionData->mFingerprints = OSDictionary::withCapacity(capacity);
+    if ( !mFirmwares || !mExpansionData->mFingerprints )
     {
+        OSSafeReleaseNULL(mFirmwares);
+        OSSafeReleaseNULL(mExpansionData->mFingerprints);
         IOLockUnlock(mFirmwareLock);
         return false;
     }
@@ -25,7 +25,10 @@
 
 #include <IOKit/IOService.h>
 #include <IOKit/IOLib.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <libkern/OSKextLib.h>
+#include <libkern/crypto/sha2.h>
+#include <kern/thread_call.h>
 
 typedef struct FirmwareDescriptor
 {
@@ -34,6 +37,25 @@ typedef struct FirmwareDescriptor
     UInt32 firmwareSize;
 } FirmwareDescriptor;
 
+/*! @typedef FirmwareFingerprint
+ *   @abstract Identifies the content of an uncompressed firmware.
+ *   @discussion The fingerprint only depends on the firmware bytes, so it stays the same across managers, reloads and power transitions. */
+
+typedef struct FirmwareFingerprint
+{
+    UInt8 hash[SHA256_DIGEST_LENGTH];
+    UInt32 size;
+} FirmwareFingerprint;
+
+/*! @typedef FirmwareCompletionAction
+ *   @abstract Called when an asynchronous firmware request finishes.
+ *   @param owner The owner passed along with the request.
+ *   @param status kIOReturnSuccess if the firmware has been decompressed and added, or the error otherwise.
+ *   @param name The name of the requested firmware.
+ *   @param firmware The uncompressed firmware, or NULL on failure. It is owned by the manager and must be retained to be kept. Like the result of getFirmwareUncompressed, it is shared and must not be modified. */
+
+typedef void (*FirmwareCompletionAction)(OSObject * owner, IOReturn status, const char * name, OSData * firmware);
+
 class OpenFirmwareManager : public IOService
 {
     OSDeclareDefaultStructors(OpenFirmwareManager)
@@ -43,6 +65,25 @@ class OpenFirmwareManager : public IOService
         OpenFirmwareManager * me;
         FirmwareDescriptor descriptor;
     };
+
+    struct FirmwareWaiter
+    {
+        FirmwareWaiter * next;
+        FirmwareCompletionAction action;
+        OSObject * owner;
+    };
+
+    struct FirmwareRequest
+    {
+        FirmwareRequest * next;
+        OpenFirmwareManager * me;
+        const OSSymbol * name;
+        OSData * firmware;
+        IOReturn status;
+        bool ready;
+        bool decoding;
+        FirmwareWaiter * waiters;
+    };
     
 public:
     static OpenFirmwareManager * withCapacity(int capacity);
@@ -82,10 +123,18 @@ public:
     virtual bool init( OSDictionary * dictionary = NULL ) APPLE_KEXT_OVERRIDE;
     virtual void free() APPLE_KEXT_OVERRIDE;
 
+    /*! @function getFirmwareUncompressed
+     *   @abstract Gets an added firmware.
+     *   @discussion The returned data is shared with other clients of the manager and, through the decoded firmware cache, with other managers, so it must not be modified. Clients that need to patch the firmware should copy it first.
+     *   @param name The name of the firmware.
+     *   @result The uncompressed firmware, owned by the manager, or NULL if no firmware with the name is added. */
+    
     virtual OSData * getFirmwareUncompressed(const char * name);
     
 protected:
     static void requestResourceCallback(OSKextRequestTag requestTag, OSReturn result, const void * resourceData, uint32_t resourceDataLength, void * context);
+    static void requestResourceAsyncCallback(OSKextRequestTag requestTag, OSReturn result, const void * resourceData, uint32_t resourceDataLength, void * context);
+    static void decodeThreadCall(thread_call_param_t param0, thread_call_param_t param1);
 
     virtual bool initWithCapacity(int capacity);
     virtual bool initWithNames(const char ** names, int capacity, FirmwareDescriptor * firmwareCandidates, int numFirmwares);
@@ -96,6 +145,71 @@ protected:
     virtual bool initWithFile(const char * kextIdentifier, const char * fileName);
     virtual bool isFirmwareCompressed(OSData * firmware);
     virtual OSData * decompressFirmware(OSData * firmware);
+
+    IOReturn inflateFirmware(const void * firmware, UInt32 firmwareSize, void * buffer, UInt32 bufferSize, UInt32 * length);
+    IOReturn measureFirmware(const void * firmware, UInt32 firmwareSize, UInt32 * length);
+    IOReturn addFirmwareWithData(const char * name, OSData * firmware);
+    FirmwareRequest * enqueueFirmwareRequest(const char * name, FirmwareCompletionAction action, OSObject * owner, IOReturn * err);
+    void readyFirmwareRequest(FirmwareRequest * request, OSData * firmware, IOReturn status);
+    void completeFirmwareRequest(FirmwareRequest * request);
+
+public:
+    // New virtual functions are only appended here, so that the vtable layout seen by existing clients is kept.
+
+    /*! @function addFirmwareWithDescriptorAsync
+     *   @abstract Adds a firmware without blocking on its decompression.
+     *   @discussion The firmware data is copied and decompressed later on a thread call, so the caller may continue bringing up its hardware in the meantime. Requests for a name that is still being decompressed are merged into the pending request, and every completion is invoked once the single decode finishes.
+     *   @param firmware The descriptor of the firmware to add.
+     *   @param action The completion to invoke when the firmware is ready. May be NULL.
+     *   @param owner The object passed to the completion. It is retained until the completion is invoked.
+     *   @result kIOReturnSuccess if the request is queued, in which case the completion is always invoked exactly once. */
+    
+    virtual IOReturn addFirmwareWithDescriptorAsync(FirmwareDescriptor firmware, FirmwareCompletionAction action = NULL, OSObject * owner = NULL);
+    virtual IOReturn addFirmwareWithNameAsync(const char * name, FirmwareDescriptor * firmwareCandidates, int numFirmwares, FirmwareCompletionAction action = NULL, OSObject * owner = NULL);
+    virtual IOReturn addFirmwareWithFileAsync(const char * kextIdentifier, const char * fileName, FirmwareCompletionAction action = NULL, OSObject * owner = NULL);
+
+    /*! @function waitForFirmware
+     *   @abstract Waits for a pending asynchronous request of a firmware to finish.
+     *   @discussion Must not be called from a completion action, as those run on the thread call that finishes the requests.
+     *   @param name The name of the firmware.
+     *   @result The uncompressed firmware, or NULL if it could not be added. It is shared and must not be modified. */
+    
+    virtual OSData * waitForFirmware(const char * name);
+
+    /*! @function copyFirmwareBuffer
+     *   @abstract Decompresses a firmware into a newly allocated, page-aligned buffer.
+     *   @discussion The firmware is written once, directly into memory that can be handed to the device for DMA or bulk transfers, without going through an intermediate OSData. The buffer is sized to the uncompressed firmware, which is taken from the size argument, the decoded firmware cache, or a size remembered from an earlier decode of the same data. Otherwise the firmware is inflated twice, once only to measure it, so callers should pass the size whenever they know it. The firmware is not added to the manager.
+     *   @param firmware The descriptor of the firmware to decompress.
+     *   @param options The options used to create the buffer, such as kIODirectionOut or kIOMemoryPhysicallyContiguous.
+     *   @param physicalMask The mask of physical addresses the buffer may occupy. If zero, any page-aligned address is allowed.
+     *   @param size The uncompressed size of the firmware if known, or zero. If it turns out to be too small, the buffer is grown and the firmware decompressed again.
+     *   @result The buffer holding the uncompressed firmware, with its length set to the firmware size. The caller must release it. */
+    
+    virtual IOBufferMemoryDescriptor * copyFirmwareBuffer(FirmwareDescriptor firmware, IOOptionBits options = kIODirectionOut, mach_vm_address_t physicalMask = 0, UInt32 size = 0);
+
+    /*! @function decompressFirmwareToBuffer
+     *   @abstract Decompresses a firmware into a buffer supplied by the caller.
+     *   @param firmware The descriptor of the firmware to decompress.
+     *   @param buffer The buffer to write to. On success, its length is set to the firmware size.
+     *   @result kIOReturnNoSpace if the capacity of the buffer is too small to hold the firmware. */
+    
+    virtual IOReturn decompressFirmwareToBuffer(FirmwareDescriptor firmware, IOBufferMemoryDescriptor * buffer);
+
+    /*! @function getFirmwareFingerprint
+     *   @abstract Gets the fingerprint of an added firmware.
+     *   @discussion Clients may keep the fingerprint of the firmware they uploaded and compare it after wake to skip uploading the same firmware again. The firmware is hashed on the first call for it, unless a fingerprint is already known from the decoded firmware cache.
+     *   @param name The name of the firmware.
+     *   @param fingerprint The fingerprint, i.e. the SHA-256 hash and size of the uncompressed firmware.
+     *   @result kIOReturnNotFound if no firmware with the name is added. */
+    
+    virtual IOReturn getFirmwareFingerprint(const char * name, FirmwareFingerprint * fingerprint);
+
+    /*! @function setDecodedCacheLimit
+     *   @abstract Sets the largest firmware this manager keeps in the decoded firmware cache.
+     *   @discussion Decompressed firmwares are cached by the fingerprint of their compressed data and shared by all managers, so adding the same firmware again, e.g. after wake, does not decompress it again. The cache holds up to 8 MB, evicting the least recently used firmwares first, and is released when the kext is unloaded. The limit only applies to this manager and defaults to the capacity of the cache.
+     *   @param limit The size in bytes of the largest uncompressed firmware to cache. Zero keeps this manager from using the cache. */
+    
+    virtual void setDecodedCacheLimit(UInt32 limit);
     
 protected:
     IOLock * mFirmwareLock;
@@ -104,6 +218,10 @@ protected:
     struct ExpansionData
     {
         IOLock * mCompletionLock;
+        thread_call_t mDecodeCall;
+        FirmwareRequest * mPendingRequests;
+        OSDictionary * mFingerprints;
+        UInt32 mDecodedCacheLimit;
     };
     ExpansionData * mExpansionData;
 };